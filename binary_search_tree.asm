@@ -9,8 +9,8 @@ BITS 64
 ;;       value should go is passed as a 'secret' first parameter in rdi
 ;;       (making all the other parameters move a position/register down)
 
-extern arena_push, arena_pos, arena_pop, arena_pop_to, arena_clear
-global bst_make, bst_clear, bst_insert, bst_find, bst_find_all, bst_inorder, bst_remove, bst_height, bst_size
+extern arena_push, arena_push_aligned, arena_pos, arena_pop, arena_pop_to, arena_clear
+global bst_make, bst_clear, bst_insert, bst_find, bst_find_all, bst_inorder, bst_remove, bst_height, bst_size, bst_compact
 
 struc BST
     .size:    resq 1 ;; u64
@@ -509,6 +509,196 @@ bst_size:
     mov rax, [rdi+BST.size]
     ret
 
+;; BST *bst_compact(BST *, Arena *dst, Entry_Remap_Callback remap)
+bst_compact:
+    ;; rdi -- BST*
+    ;; rsi -- Arena* (destination)
+    ;; rdx -- remap callback (may be NIL)
+    push rbp
+    mov rbp, rsp
+    sub rsp, 80
+    ;;  [rsp+72]         -- old arena pos after pushing the old node queue
+    ;;  [rsp+64]         -- old arena pos before pushing the old node queue
+    ;;  [rsp+56]         -- old node queue tail
+    ;;  [rsp+48]         -- old node queue head
+    ;;  [rsp+40]         -- queue tail (one past the last copied Node*)
+    ;;  [rsp+32]         -- queue head (next copied Node* whose children are still old)
+    ;;  [rsp+24]         -- new BST*
+    mov [rsp+16], rdx ;; -- remap callback
+    mov [rsp+8], rsi  ;; -- Arena* (destination)
+    mov [rsp], rdi    ;; -- BST*
+
+    mov rdi, [rsp+8]
+    mov rsi, BST_size
+    mov rdx, 8
+    call arena_push_aligned
+    ;; rax -- new BST*
+    mov [rsp+24], rax
+    mov r8, [rsp]
+    mov r9, [r8+BST.size]
+    mov [rax+BST.size], r9
+    mov r9, [r8+BST.height]
+    mov [rax+BST.height], r9
+    mov r9, [r8+BST.key_cmp]
+    mov [rax+BST.key_cmp], r9
+    mov r9, [rsp+8]
+    mov [rax+BST.arena], r9
+
+    mov rsi, [r8+BST.root]
+    test rsi, rsi
+    jz .exit
+    mov rdi, [rsp+8]
+    call _bst_compact_node
+    mov r8, [rsp+24]
+    mov [r8+BST.root], rax
+    mov [rsp+32], rax
+    lea rax, [rax+Node_size]
+    mov [rsp+40], rax
+
+    ;; first pass, breadth-first copy: the copied nodes themselves are the queue,
+    ;; since nothing but _bst_compact_node pushes into dst until the copy is done
+    ;; (every copy is pushed 8-aligned right behind the previous one, no padding in between)
+.compact_loop:
+    mov r8, [rsp+32]
+    cmp r8, [rsp+40]
+    je .compact_done
+
+    mov rsi, [r8+Node.left]
+    test rsi, rsi
+    jz .check_right
+    mov rdi, [rsp+8]
+    call _bst_compact_node
+    mov r8, [rsp+32]
+    mov [r8+Node.left], rax
+    lea rax, [rax+Node_size]
+    mov [rsp+40], rax
+
+.check_right:
+    mov rsi, [r8+Node.right]
+    test rsi, rsi
+    jz .next_in_queue
+    mov rdi, [rsp+8]
+    call _bst_compact_node
+    mov r8, [rsp+32]
+    mov [r8+Node.right], rax
+    lea rax, [rax+Node_size]
+    mov [rsp+40], rax
+
+.next_in_queue:
+    add qword [rsp+32], Node_size
+    jmp .compact_loop
+
+.compact_done:
+    mov rax, [rsp+16]
+    test rax, rax
+    jz .exit
+
+    ;; second pass, remap: the callback may push into dst (or anywhere else),
+    ;; so it only runs once the copy is complete.
+    ;; the old nodes are queued breadth-first (in the old arena, like bst_inorder's stack),
+    ;; which lines them up one-to-one with the copies in dst.
+    mov rdi, [rsp]
+    mov rdi, [rdi+BST.arena]
+    call arena_pos
+    mov [rsp+64], rax
+    mov rdi, [rsp]
+    mov rsi, [rdi+BST.size]
+    shl rsi, 3 ;; pointer size (Node *)
+    mov rdi, [rdi+BST.arena]
+    call arena_push
+    mov [rsp+48], rax
+    mov rdi, [rsp]
+    mov rdi, [rdi+BST.arena]
+    call arena_pos
+    mov [rsp+72], rax
+
+    mov r10, [rsp+48] ;; r10 -- old queue head
+    mov r8, [rsp]
+    mov r9, [r8+BST.root]
+    mov [r10], r9
+    lea r11, [r10+8]  ;; r11 -- old queue tail
+.queue_loop:
+    cmp r10, r11
+    je .queue_done
+    mov r9, [r10]
+    mov rcx, [r9+Node.left]
+    test rcx, rcx
+    jz .queue_right
+    mov [r11], rcx
+    add r11, 8
+.queue_right:
+    mov rcx, [r9+Node.right]
+    test rcx, rcx
+    jz .queue_next
+    mov [r11], rcx
+    add r11, 8
+.queue_next:
+    add r10, 8
+    jmp .queue_loop
+
+.queue_done:
+    mov [rsp+56], r11
+    mov r8, [rsp+24]
+    mov r8, [r8+BST.root]
+    mov [rsp+40], r8 ;; reuse: current copied Node*
+.remap_loop:
+    mov r8, [rsp+48]
+    cmp r8, [rsp+56]
+    je .remap_done
+    ;; remap(old_entry, new_entry)
+    mov rdi, [r8]
+    mov rsi, [rsp+40]
+    call [rsp+16]
+    add qword [rsp+48], 8
+    add qword [rsp+40], Node_size
+    jmp .remap_loop
+
+.remap_done:
+    ;; give the old node queue back, unless the callback pushed on top of it
+    mov rdi, [rsp]
+    mov rdi, [rdi+BST.arena]
+    call arena_pos
+    cmp rax, [rsp+72]
+    jne .exit
+    mov rdi, [rsp]
+    mov rdi, [rdi+BST.arena]
+    mov rsi, [rsp+64]
+    call arena_pop_to
+
+.exit:
+    mov rax, [rsp+24] ;; rax -- new BST*
+    mov rsp, rbp
+    pop rbp
+    ret
+
+;; Node *_bst_compact_node(Arena *dst, Node *old)
+_bst_compact_node:
+    ;; rdi -- Arena* (destination)
+    ;; rsi -- Node* (old)
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rsp], rsi ;; -- Node* (old)
+
+    mov rsi, Node_size
+    mov rdx, 8
+    call arena_push_aligned
+    ;; rax -- Node* (new)
+    ;; children still point into the old arena, they get fixed up once dequeued
+    mov r8, [rsp]
+    mov r9, [r8+Node.key]
+    mov [rax+Node.key], r9
+    mov r9, [r8+Node.val]
+    mov [rax+Node.val], r9
+    mov r9, [r8+Node.left]
+    mov [rax+Node.left], r9
+    mov r9, [r8+Node.right]
+    mov [rax+Node.right], r9
+
+    mov rsp, rbp
+    pop rbp
+    ret
+
 section .bss
 
 section .data
@@ -34,6 +34,7 @@ struct Entries {
 };
 
 typedef void (*Entry_Callback)(Entry *);
+typedef void (*Entry_Remap_Callback)(Entry *old_entry, Entry *new_entry);
 
 extern BST *bst_make(Arena *, Compare_Func key_cmp);
 extern void bst_clear(BST *);
@@ -44,3 +45,10 @@ extern U64 bst_height(BST *);
 extern U64 bst_size(BST *);
 extern void bst_inorder(BST *, Entry_Callback cb);
 extern Entry *bst_remove(BST *, Entry *entry);
+// Copies the header and all live nodes (breadth-first) into dst and returns the new BST*.
+// remap (optional) is called once per entry with (old, new), after all nodes are copied;
+// it may allocate from dst. With remap, size * 8 bytes of scratch queue are pushed into the
+// source tree's arena (kept if the callback pushes on top of it). Afterwards the old BST* and all old Entry* are stale.
+// Keys and values are not copied, they still point to wherever they were allocated.
+// The source arena is not released, the caller releases it (once no keys/values live there).
+extern BST *bst_compact(BST *, Arena *dst, Entry_Remap_Callback remap);
@@ -75,6 +75,7 @@ U8 test_find_all(Arena *);
 U8 test_remove_height(Arena *);
 U8 test_remove_a_key_that_wont_be_found_first(Arena *);
 U8 test_string_key(Arena *arena);
+U8 test_compact(Arena *arena);
 
 typedef U8 (*Test_Function)(Arena *);
 
@@ -89,6 +90,7 @@ static Test_Function TEST_FUNCTIONS[] = {
     test_remove_height,
     test_remove_a_key_that_wont_be_found_first,
     test_string_key,
+    test_compact,
     0,
 };
 
@@ -467,3 +469,111 @@ test_string_key(Arena *arena) {
     TEST_ASSERT(removed == second_one);
     return 1;
 }
+
+static Arena *remap_arena;
+static Entry **remap_pairs;
+static U64 remap_count;
+static Entry *remap_old_entry;
+static Entry *remap_new_entry;
+static void
+remap_entry(Entry *old_entry, Entry *new_entry) {
+    // record the mapping in the destination arena (the copy has already finished)
+    Entry **pair = push_array(remap_arena, Entry *, 2);
+    pair[0] = old_entry;
+    pair[1] = new_entry;
+    if (remap_count == 0) {
+        remap_pairs = pair;
+    }
+    remap_count = remap_count + 1;
+    if (old_entry == remap_old_entry) {
+        remap_new_entry = new_entry;
+    }
+}
+
+static U8
+test_compact_layout(BST *compact) {
+    TEST_ASSERT(bst_size(compact) == 7);
+    TEST_ASSERT(bst_height(compact) == 4);
+
+    // breadth-first: root followed by its children
+    Node *root = compact->root;
+    TEST_ASSERT(*(U64*)root->key == 5);
+    TEST_ASSERT(root->left == root + 1);
+    TEST_ASSERT(root->right == root + 2);
+
+    ArrayEntries *entries = malloc(sizeof(ArrayEntries));
+    collect_to_entries_result = &entries;
+    bst_inorder(compact, &collect_to_entries);
+    U64 expected[7] = {1, 3, 5, 10, 11, 37, 40};
+    TEST_ASSERT(entries->size == 7);
+    for (U64 i = 0; i < entries->size; ++i) {
+        TEST_ASSERT(*(U64*)entries->data[i].key == expected[i]);
+    }
+    return 1;
+}
+
+static U8
+test_compact_into(Arena *arena, Arena **tmp, Arena *dst) {
+    // tree lives in tmp, keys in arena (so tmp can be released after compaction)
+    BST *empty = bst_make(*tmp, &u64_cmp);
+    BST *compact_empty = bst_compact(empty, dst, 0);
+    TEST_ASSERT(compact_empty->root == 0);
+    TEST_ASSERT(bst_size(compact_empty) == 0);
+
+    BST *bst = bst_make(*tmp, &u64_cmp);
+    bst_insert(bst, hoist_u64(arena, 5), 0);
+    Entry *e_two = bst_insert(bst, hoist_u64(arena, 2), 0);
+    bst_insert(bst, hoist_u64(arena, 1), 0);
+    bst_insert(bst, hoist_u64(arena, 3), 0);
+    Entry *e_twelve = bst_insert(bst, hoist_u64(arena, 12), 0);
+    bst_insert(bst, hoist_u64(arena, 10), 0);
+    Entry *e_thirty_seven = bst_insert(bst, hoist_u64(arena, 37), 0);
+    bst_insert(bst, hoist_u64(arena, 40), 0);
+    bst_insert(bst, hoist_u64(arena, 11), 0);
+    bst_remove(bst, e_two);
+    bst_remove(bst, e_twelve);
+    TEST_ASSERT(bst_size(bst) == 7);
+    TEST_ASSERT(bst_height(bst) == 4);
+
+    BST *plain = bst_compact(bst, dst, 0);
+    TEST_ASSERT(test_compact_layout(plain));
+
+    remap_arena = dst;
+    remap_pairs = 0;
+    remap_count = 0;
+    remap_old_entry = e_thirty_seven;
+    remap_new_entry = 0;
+    BST *compact = bst_compact(bst, dst, &remap_entry);
+    TEST_ASSERT(remap_count == 7);
+
+    // every old entry must be paired with its own copy (old entries still readable here)
+    Entry *nodes_begin = (Entry *) compact->root;
+    Entry *nodes_end = (Entry *) (compact->root + 7);
+    for (U64 i = 0; i < remap_count; ++i) {
+        Entry **pair = &remap_pairs[i*2];
+        TEST_ASSERT(*(U64*)pair[0]->key == *(U64*)pair[1]->key);
+        TEST_ASSERT(pair[1] >= nodes_begin && pair[1] < nodes_end);
+    }
+
+    arena_release(*tmp);
+    *tmp = 0;
+
+    TEST_ASSERT(test_compact_layout(compact));
+
+    Entry *found = bst_find(compact, hoist_u64(arena, 37));
+    TEST_ASSERT(found != 0);
+    TEST_ASSERT(found != e_thirty_seven);
+    TEST_ASSERT(found == remap_new_entry);
+    TEST_ASSERT((U8 *) found > dst->data && (U8 *) found < dst->data + dst->pos);
+    return 1;
+}
+
+U8
+test_compact(Arena *arena) {
+    Arena *tmp = arena_make(16*KB(4));
+    Arena *dst = arena_make(16*KB(4));
+    U8 ok = test_compact_into(arena, &tmp, dst);
+    if (tmp) arena_release(tmp);
+    arena_release(dst);
+    return ok;
+}